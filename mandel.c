@@ -15,13 +15,28 @@
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include "jpegrw.h"
 
+#define PREPASS_CELLS 256 // Cells per side of the coarse grid used to pick Buddhabrot starting points
+#define IMPORTANCE_LEVELS 8 // Pre-pass cells are drawn with weights 1, 2, 4 ... 128, see build_sample_cells
+#define SAMPLE_RADIUS 2.0 // Buddhabrot starting points are drawn from [-2,2]x[-2,2]
+#define DE_BAILOUT 1e6    // Squared escape radius for distance estimation, large so the estimate converges
+#define DE_LINE_WIDTH 2.0 // Distance, in pixels, over which the boundary fades from black to white
+
 // local routines
 static int iteration_to_color(int i, int max);
 static int iterations_at_point(double x, double y, int max);
+static double distance_at_point(double x, double y, int max);
+static int distance_to_color(double distance, double pixel_size);
+static int in_main_bulbs(double x, double y);
+static double image_psnr(const imgRawImage *a, const imgRawImage *b);
 static void compute_image(imgRawImage *img, double xmin, double xmax, double ymin,double ymax, int max, int row_start, int row_end);
 static void show_help();
+static void render_buddhabrot(imgRawImage *img, double xmin, double xmax, double ymin, double ymax);
+static void parse_band(const char *arg, int channel);
 
 // File-scope variables to share with threads
 static pthread_mutex_t mutex;
@@ -43,12 +58,46 @@ static int image_height = 1000;
 static int max = 1000;
 static int num_threads = 1;
 static imgRawImage *img = NULL;
+static int distance_mode = 0;         // Color by exterior distance estimate instead of escape time
+static int mask_mode = 0;             // Color escape time as a black and white mask of the set
+static int supersample = 1;           // Samples per pixel along each axis
+static const char *reference = NULL;  // Image to report the PSNR against
+
+// Buddhabrot (orbit density) configuration
+static int buddhabrot = 0;
+static long num_orbits = 10000000;
+static int band_min[3] = {0, 0, 0}; // Per-channel (R,G,B) iteration bands min <= iters < max
+static int band_max[3] = {0, 0, 0}; // 0 means use max
+static int band_top = 0;            // Largest of the bands, calc later
+
+// Per-thread state for the Buddhabrot renderer. Every thread owns its histogram,
+// so tracing orbits never writes to memory shared with another thread.
+// Aligned to a cache line so neighbouring threads' arguments never share one.
+typedef struct
+{
+	int id;
+	long orbits;      // Number of starting points this thread samples
+	long plotted;     // Number of those whose orbit added counts to the view
+	uint64_t rng;     // xorshift64* state
+	uint32_t *hist;   // width * height * 3 counters, one per channel
+} __attribute__((aligned(64))) buddha_arg;
+
+static buddha_arg *buddha_args = NULL;
+static uint32_t *histogram = NULL; // Reduced histogram, summed over all threads
+static int *cells = NULL;               // Coarse grid cells worth sampling from
+static unsigned char *cell_level = NULL; // Each cell is drawn with weight 2^level
+static uint64_t *cell_cdf = NULL;        // Running sum of the cell weights
+static uint64_t total_weight = 0;
+static int num_cells = 0;
+static pthread_barrier_t barrier;
+static double view_xmin, view_xmax, view_ymin, view_ymax;
 
 
 /**
  * @brief This function is the entry point for each thread in the program. Uses a mutex to lock the critical section, 
- * and a semaphore to limit the number of threads running at once. The mutex ensures that only one thread can access the critical section at a time
- * to prevent race conditions. The semaphore ensures that only num_threads number of threads are running at once.
+ * and a semaphore to limit the number of threads running at once. The mutex ensures that only one thread at a time claims
+ * the next block of rows, to prevent race conditions. The rows themselves are computed outside the lock, so threads run in parallel.
+ * The semaphore ensures that only num_threads number of threads are running at once.
  * 
  * @param vp A pointer to the thread argument (not used in this function).
  * @return void* Always returns NULL.
@@ -58,17 +107,19 @@ void *thread_process(void *vp)
 	// Lock mutex
 	pthread_mutex_lock(&mutex);
 
-	// Critical section
-	static int row_start = 0;
-	int row_end = row_start + rows_per_thread;
+	// Critical section: claim the next block of rows
+	static int next_row = 0;
+	int row_start = next_row;
+	int row_end = (row_start + rows_per_thread < image_height) ? row_start + rows_per_thread : image_height;
 
-	compute_image(img, xcenter - xscale / 2, xcenter + xscale / 2, ycenter - yscale / 2, ycenter + yscale / 2, max, row_start, row_end);
-	
-	row_start += rows_per_thread;
+	next_row = row_end;
 
 	// Unlock mutex
 	pthread_mutex_unlock(&mutex);
 
+	// Rows [row_start, row_end) belong to this thread only, so no lock is needed to compute them
+	compute_image(img, xcenter - xscale / 2, xcenter + xscale / 2, ycenter - yscale / 2, ycenter + yscale / 2, max, row_start, row_end);
+
 	// Post to semaphore
 	sem_post(&sem);
 
@@ -80,7 +131,7 @@ int main(int argc, char *argv[])
 	// For each command line argument given,
 	// override the appropriate configuration value.
 	int c;
-	while ((c = getopt(argc, argv, "x:y:s:W:H:m:o:h:t:")) != -1)
+	while ((c = getopt(argc, argv, "x:y:s:W:H:m:o:h:t:bn:R:G:B:dMS:P:")) != -1)
 	{
 		switch (c)
 		{
@@ -108,6 +159,37 @@ int main(int argc, char *argv[])
 		case 'o':
 			outfile = optarg;
 			break;
+		case 'b':
+			buddhabrot = 1;
+			break;
+		case 'n':
+			num_orbits = atol(optarg);
+			break;
+		case 'R':
+			parse_band(optarg, 0);
+			break;
+		case 'G':
+			parse_band(optarg, 1);
+			break;
+		case 'B':
+			parse_band(optarg, 2);
+			break;
+		case 'd':
+			distance_mode = 1;
+			break;
+		case 'M':
+			mask_mode = 1;
+			break;
+		case 'S':
+			supersample = atoi(optarg);
+			if (supersample < 1)
+			{
+				supersample = 1;
+			}
+			break;
+		case 'P':
+			reference = optarg;
+			break;
 		case 'h':
 			show_help();
 			exit(1);
@@ -139,29 +221,72 @@ int main(int argc, char *argv[])
 	// Calculate the number of rows per thread
 	rows_per_thread = (image_height % num_threads == 0) ? image_height / num_threads : image_height / num_threads + 1;
 
-	// Create threads
-	for (int index = 0; index < num_threads; index++)
+	if (buddhabrot)
+	{
+		render_buddhabrot(img, xcenter - xscale / 2, xcenter + xscale / 2, ycenter - yscale / 2, ycenter + yscale / 2);
+	}
+	else
 	{
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
-		sem_wait(&sem);
-		int ret = pthread_create(&threads[index], NULL, thread_process, NULL);
+		// Create threads
+		for (int index = 0; index < num_threads; index++)
+		{
 
-		if (ret != 0)
+			sem_wait(&sem);
+			int ret = pthread_create(&threads[index], NULL, thread_process, NULL);
+
+			if (ret != 0)
+			{
+				printf("Error creating thread %d\n", index);
+				exit(1);
+			}
+		}
+		// Join threads, so main doesn't exit before threads are done
+		for (int i = 0; i < num_threads; i++)
 		{
-			printf("Error creating thread %d\n", index);
-			exit(1);
+			pthread_join(threads[i], NULL);
 		}
-	}
-	// Join threads, so main doesn't exit before threads are done
-	for (int i = 0; i < num_threads; i++)
-	{
-		pthread_join(threads[i], NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("render: %s %dx%d samples/pixel in %f s\n", distance_mode ? "distance" : "escape-time", supersample, supersample, seconds);
 	}
 
 	
 	// Save the image in the stated file.
 	storeJpegImageFile(img, outfile);
 
+	// Compare against a reference image, e.g. a heavily supersampled render of the same view
+	if (reference != NULL)
+	{
+		imgRawImage *ref = loadJpegImageFile(reference);
+
+		if (ref == NULL)
+		{
+			printf("Error reading reference image %s\n", reference);
+		}
+		else if (ref->width != img->width || ref->height != img->height)
+		{
+			printf("Reference image %s is %ux%u, expected %ux%u\n", reference, ref->width, ref->height, img->width, img->height);
+		}
+		else if (ref->numComponents != 3)
+		{
+			// Only RGB references fill the whole buffer
+			printf("Reference image %s has %u components, expected 3 (RGB)\n", reference, ref->numComponents);
+		}
+		else
+		{
+			printf("psnr: %f dB against %s\n", image_psnr(img, ref), reference);
+		}
+
+		if (ref != NULL)
+		{
+			freeRawImage(ref);
+		}
+	}
+
 	// Destroy mutex
 	pthread_mutex_destroy(&mutex);
 
@@ -204,12 +329,81 @@ int iterations_at_point(double x, double y, int max)
 	return iter;
 }
 
+/*
+Return the exterior distance estimate at point x, y, tracking the derivative dz/dc alongside z.
+Returns 0 for points that do not escape within max iterations, which are treated as inside the set.
+*/
+
+double distance_at_point(double x, double y, int max)
+{
+	double x0 = x;
+	double y0 = y;
+
+	// dz/dc of z1 = c
+	double dx = 1;
+	double dy = 0;
+
+	int iter = 0;
+
+	// Nothing to estimate inside the main cardioid and period-2 bulb
+	if (in_main_bulbs(x0, y0))
+	{
+		return 0;
+	}
+
+	while ((x * x + y * y <= DE_BAILOUT) && iter < max)
+	{
+		// dz' = 2 * z * dz + 1
+		double dxt = 2 * (x * dx - y * dy) + 1;
+		double dyt = 2 * (x * dy + y * dx);
+
+		double xt = x * x - y * y + x0;
+		double yt = 2 * x * y + y0;
+
+		dx = dxt;
+		dy = dyt;
+		x = xt;
+		y = yt;
+
+		iter++;
+	}
+
+	if (iter >= max)
+	{
+		return 0;
+	}
+
+	// d = |z| * ln|z| / |dz|
+	double mag2 = x * x + y * y;
+	return sqrt(mag2 / (dx * dx + dy * dy)) * 0.5 * log(mag2);
+}
+
+/*
+Compute the color of a single point, using whichever mode was selected.
+*/
+static int color_at_point(double x, double y, int max, double pixel_size)
+{
+	if (distance_mode)
+	{
+		return distance_to_color(distance_at_point(x, y, max), pixel_size);
+	}
+
+	int iters = iterations_at_point(x, y, max);
+	if (mask_mode)
+	{
+		// Same palette as the distance mode: white outside the set, black inside
+		return (iters < max) ? 0xFFFFFF : 0;
+	}
+	return iteration_to_color(iters, max);
+}
+
 /*
 Compute an entire Mandelbrot image, writing each point to the given bitmap.
 Scale the image to the range (xmin-xmax,ymin-ymax), limiting iterations to "max"
 Each thread computes n-rows
 
-MODIFIED: Added row_start and row_end to compute n-rows per thread so that multiple threads can compute the image in parallel
+MODIFIED: Added row_start and row_end (exclusive) to compute n-rows per thread so that multiple threads can compute the image in parallel
+MODIFIED: Averages supersample x supersample points per pixel when supersampling is on
 */
 
 void compute_image(imgRawImage *img, double xmin, double xmax, double ymin, double ymax, int max, int row_start, int row_end)
@@ -220,23 +414,509 @@ void compute_image(imgRawImage *img, double xmin, double xmax, double ymin, doub
 	int width = img->width;
 	int height = img->height;
 
+	// Size of a pixel in x,y space
+	double pixel_size = (xmax - xmin) / width;
+
 	// For every pixel in the image...
-	for (j = row_start; j <= row_end; j++)
+	for (j = row_start; j < row_end; j++)
 	{
 
 		for (i = 0; i < width; i++)
 		{
+			if (supersample == 1)
+			{
+				// Determine the point in x,y space for that pixel.
+				double x = xmin + i * (xmax - xmin) / width;
+				double y = ymin + j * (ymax - ymin) / height;
+
+				// Set the pixel in the bitmap.
+				setPixelCOLOR(img, i, j, color_at_point(x, y, max, pixel_size));
+				continue;
+			}
+
+			// Average a grid of points centered on the pixel's point, channel by channel
+			int red = 0, green = 0, blue = 0;
+
+			for (int sy = 0; sy < supersample; sy++)
+			{
+				for (int sx = 0; sx < supersample; sx++)
+				{
+					double x = xmin + (i + (sx + 0.5) / supersample - 0.5) * (xmax - xmin) / width;
+					double y = ymin + (j + (sy + 0.5) / supersample - 0.5) * (ymax - ymin) / height;
+
+					int color = color_at_point(x, y, max, pixel_size);
+					red += (color & 0xFF0000) >> 16;
+					green += (color & 0xFF00) >> 8;
+					blue += color & 0xFF;
+				}
+			}
+
+			int samples = supersample * supersample;
+			setPixelRGB(img, i, j, red / samples, green / samples, blue / samples);
+		}
+	}
+}
+
+/*
+Return nonzero if x, y lies in the main cardioid or the period-2 bulb.
+Those points never escape, so there is no orbit to trace.
+*/
+static int in_main_bulbs(double x, double y)
+{
+	double xq = x - 0.25;
+	double q = xq * xq + y * y;
+
+	if (q * (q + xq) <= 0.25 * y * y)
+	{
+		return 1;
+	}
+	return (x + 1) * (x + 1) + y * y <= 0.0625;
+}
+
+/*
+xorshift64* generator. Each Buddhabrot thread keeps its own state,
+so drawing random numbers needs no locking.
+*/
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform double in [0, 1)
+static double next_uniform(uint64_t *state)
+{
+	return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+/*
+Trace the orbit of c = (cx, cy). If it escapes within one of the channel bands,
+add weight to hist for every point of the orbit that lands in the view, for those channels.
+With a NULL hist nothing is written, which the pre-pass uses to score cells.
+Returns the number of counts the orbit adds to the view, summed over channels.
+*/
+static int trace_orbit(uint32_t *hist, double cx, double cy, uint32_t weight)
+{
+	int width = img->width;
+	int height = img->height;
+	int hits = 0;
+
+	if (in_main_bulbs(cx, cy))
+	{
+		return 0;
+	}
+
+	// First pass: find out whether and when the orbit escapes
+	int iters = iterations_at_point(cx, cy, band_top);
+	if (iters >= band_top)
+	{
+		return 0;
+	}
+
+	// Channels whose band this orbit falls in
+	int channels[3];
+	int num_channels = 0;
+	for (int c = 0; c < 3; c++)
+	{
+		if (iters >= band_min[c] && iters < band_max[c])
+		{
+			channels[num_channels++] = c;
+		}
+	}
+	if (num_channels == 0)
+	{
+		return 0;
+	}
+
+	// Second pass: replay the orbit and accumulate it. The starting point itself is skipped since
+	// it is just the sample position. The short orbits from the rest of the radius 2 disc still
+	// leave a flat haze, which a band minimum removes.
+	double xs = width / (view_xmax - view_xmin);
+	double ys = height / (view_ymax - view_ymin);
+	double x = cx;
+	double y = cy;
+
+	for (int k = 1; k < iters; k++)
+	{
+		double xt = x * x - y * y + cx;
+		double yt = 2 * x * y + cy;
+
+		x = xt;
+		y = yt;
+
+		double px = (x - view_xmin) * xs;
+		double py = (y - view_ymin) * ys;
+
+		if (px >= 0 && px < width && py >= 0 && py < height)
+		{
+			hits += num_channels;
+			if (hist == NULL)
+			{
+				continue;
+			}
+
+			uint32_t *bin = &hist[((int)py * width + (int)px) * 3];
+			for (int c = 0; c < num_channels; c++)
+			{
+				// Saturate rather than wrap around
+				uint32_t *count = &bin[channels[c]];
+				*count = (UINT32_MAX - *count < weight) ? UINT32_MAX : *count + weight;
+			}
+		}
+	}
+
+	return hits;
+}
+
+// What the pre-pass learned about one probe point
+typedef struct
+{
+	int bounded; // Did not escape within band_top iterations
+	int in_band; // Escaped within at least one channel band
+	int hits;    // Counts its orbit adds to the view
+} probe;
+
+static probe probe_point(double x, double y)
+{
+	probe p = {0, 0, 0};
+	int iters = in_main_bulbs(x, y) ? band_top : iterations_at_point(x, y, band_top);
+
+	if (iters >= band_top)
+	{
+		p.bounded = 1;
+		return p;
+	}
+
+	for (int c = 0; c < 3; c++)
+	{
+		if (iters >= band_min[c] && iters < band_max[c])
+		{
+			p.in_band = 1;
+		}
+	}
+	p.hits = trace_orbit(NULL, x, y, 0);
+	return p;
+}
+
+/*
+Coarse escape-time pre-pass for importance sampling.
+Splits [-2,2]x[-2,2] into PREPASS_CELLS^2 cells and probes the corners and center of each.
+A cell is drawn with weight 2^level, and each sample from it adds 2^(IMPORTANCE_LEVELS-1-level)
+instead of 1, so the weights cancel and the density stays unbiased. The level is 0 if all five
+probes stay bounded (those samples are expensive and rarely plot anything), otherwise 1, plus one
+per probe escaping within a band, plus one if any probe's orbit reaches the view.
+Every cell that could contribute keeps a nonzero weight, so filaments between probes are not lost.
+
+Only two kinds of cells are dropped. Cells entirely outside the radius 2 circle escape before
+their first plotted point, so dropping them is exact. Cells whose five probes all lie in the main
+cardioid or period-2 bulb are assumed to lie inside them; that is a slight bias where a cell
+straddles the cardioid's cusp or the bulbs' junction.
+*/
+static void build_sample_cells(void)
+{
+	const int n = PREPASS_CELLS;
+	const double step = 2 * SAMPLE_RADIUS / n;
+	probe *corner = malloc(sizeof(probe) * (n + 1) * (n + 1));
+
+	cells = malloc(sizeof(int) * n * n);
+	cell_level = malloc(n * n);
+	cell_cdf = malloc(sizeof(uint64_t) * n * n);
+	if (corner == NULL || cells == NULL || cell_level == NULL || cell_cdf == NULL)
+	{
+		printf("Error allocating Buddhabrot pre-pass\n");
+		exit(1);
+	}
+
+	// Corners are shared between neighbouring cells, so probe each once
+	for (int j = 0; j <= n; j++)
+	{
+		for (int i = 0; i <= n; i++)
+		{
+			corner[j * (n + 1) + i] = probe_point(-SAMPLE_RADIUS + i * step, -SAMPLE_RADIUS + j * step);
+		}
+	}
+
+	num_cells = 0;
+	total_weight = 0;
+
+	for (int j = 0; j < n; j++)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			double x0 = -SAMPLE_RADIUS + i * step;
+			double y0 = -SAMPLE_RADIUS + j * step;
+
+			// Point of the cell closest to the origin
+			double nx = (x0 > 0) ? x0 : (x0 + step < 0) ? x0 + step : 0;
+			double ny = (y0 > 0) ? y0 : (y0 + step < 0) ? y0 + step : 0;
+			if (nx * nx + ny * ny > SAMPLE_RADIUS * SAMPLE_RADIUS)
+			{
+				continue;
+			}
+
+			if (in_main_bulbs(x0, y0) && in_main_bulbs(x0 + step, y0) && in_main_bulbs(x0, y0 + step) &&
+				in_main_bulbs(x0 + step, y0 + step) && in_main_bulbs(x0 + step / 2, y0 + step / 2))
+			{
+				continue;
+			}
+
+			probe probes[5] = {corner[j * (n + 1) + i], corner[j * (n + 1) + i + 1],
+							   corner[(j + 1) * (n + 1) + i], corner[(j + 1) * (n + 1) + i + 1],
+							   probe_point(x0 + step / 2, y0 + step / 2)};
+
+			int bounded = 0;
+			int in_band = 0;
+			int hits = 0;
+			for (int k = 0; k < 5; k++)
+			{
+				bounded += probes[k].bounded;
+				in_band += probes[k].in_band;
+				hits += probes[k].hits;
+			}
+
+			int level = (bounded == 5) ? 0 : 1 + in_band + (hits > 0);
+
+			cells[num_cells] = j * n + i;
+			cell_level[num_cells] = level;
+			total_weight += 1u << level;
+			cell_cdf[num_cells] = total_weight;
+			num_cells++;
+		}
+	}
+
+	free(corner);
+}
+
+/*
+Entry point for each Buddhabrot thread. Samples its share of orbits into its own histogram,
+then waits for every other thread and sums one slice of all the histograms into the shared one.
+Slices do not overlap, so the reduction needs no locking either.
+*/
+void *buddhabrot_process(void *vp)
+{
+	buddha_arg *arg = vp;
+	const double step = 2 * SAMPLE_RADIUS / PREPASS_CELLS;
+
+	// Work on local copies so the hot loop never touches arg, which shares
+	// memory with the other threads' arguments
+	uint64_t rng = arg->rng;
+	uint32_t *hist = arg->hist;
+	long orbits = arg->orbits;
+	long plotted = 0;
+
+	for (long k = 0; k < orbits; k++)
+	{
+		// Pick a cell in proportion to its weight, then a uniform point inside it
+		uint64_t r = next_random(&rng) % total_weight;
+		int lo = 0;
+		int hi = num_cells - 1;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (cell_cdf[mid] > r)
+			{
+				hi = mid;
+			}
+			else
+			{
+				lo = mid + 1;
+			}
+		}
 
-			// Determine the point in x,y space for that pixel.
-			double x = xmin + i * (xmax - xmin) / width;
-			double y = ymin + j * (ymax - ymin) / height;
+		int cell = cells[lo];
+		double cx = -SAMPLE_RADIUS + (cell % PREPASS_CELLS + next_uniform(&rng)) * step;
+		double cy = -SAMPLE_RADIUS + (cell / PREPASS_CELLS + next_uniform(&rng)) * step;
+
+		// Divide by the cell's sampling weight so heavily sampled cells are not over-counted
+		uint32_t weight = 1u << (IMPORTANCE_LEVELS - 1 - cell_level[lo]);
+		plotted += trace_orbit(hist, cx, cy, weight) > 0;
+	}
 
-			// Compute the iterations at that point.
-			int iters = iterations_at_point(x, y, max);
+	arg->rng = rng;
+	arg->plotted = plotted;
 
-			// Set the pixel in the bitmap.
-			setPixelCOLOR(img, i, j, iteration_to_color(iters, max));
+	pthread_barrier_wait(&barrier);
+
+	// Parallel reduction of this thread's slice
+	size_t total = (size_t)img->width * img->height * 3;
+	size_t chunk = (total + num_threads - 1) / num_threads;
+	size_t start = chunk * arg->id;
+	size_t end = (start + chunk < total) ? start + chunk : total;
+
+	for (size_t i = start; i < end; i++)
+	{
+		uint64_t sum = 0;
+		for (int t = 0; t < num_threads; t++)
+		{
+			sum += buddha_args[t].hist[i];
 		}
+		histogram[i] = (sum > UINT32_MAX) ? UINT32_MAX : (uint32_t)sum;
+	}
+
+	return NULL;
+}
+
+/*
+Render an orbit density (Buddhabrot) image of the range (xmin-xmax,ymin-ymax).
+Each channel counts the orbits escaping within its band (min <= iters < max), so different bands per channel give a Nebulabrot.
+Counts are mapped to brightness with a square root so faint orbits stay visible.
+*/
+void render_buddhabrot(imgRawImage *img, double xmin, double xmax, double ymin, double ymax)
+{
+	struct timespec start, end;
+	size_t total = (size_t)img->width * img->height * 3;
+
+	view_xmin = xmin;
+	view_xmax = xmax;
+	view_ymin = ymin;
+	view_ymax = ymax;
+
+	for (int c = 0; c < 3; c++)
+	{
+		if (band_max[c] <= 0)
+		{
+			band_max[c] = max;
+		}
+	}
+
+	band_top = band_max[0];
+	for (int c = 1; c < 3; c++)
+	{
+		if (band_max[c] > band_top)
+		{
+			band_top = band_max[c];
+		}
+	}
+
+	build_sample_cells();
+	if (num_cells == 0)
+	{
+		printf("buddhabrot: no cells to sample from\n");
+		free(cells);
+		free(cell_level);
+		free(cell_cdf);
+		return;
+	}
+
+	printf("buddhabrot: orbits=%ld bands=%d:%d/%d:%d/%d:%d sampling %d of %d cells\n",
+		   num_orbits, band_min[0], band_max[0], band_min[1], band_max[1], band_min[2], band_max[2],
+		   num_cells, PREPASS_CELLS * PREPASS_CELLS);
+
+	// Every thread gets a full width * height * 3 histogram, e.g. 12 MB each at 1000x1000
+	buddha_args = aligned_alloc(64, sizeof(buddha_arg) * num_threads);
+	histogram = malloc(sizeof(uint32_t) * total);
+	if (buddha_args == NULL || histogram == NULL)
+	{
+		printf("Error allocating Buddhabrot histogram\n");
+		exit(1);
+	}
+	pthread_barrier_init(&barrier, NULL, num_threads);
+
+	uint64_t seed = (uint64_t)time(NULL);
+	for (int t = 0; t < num_threads; t++)
+	{
+		buddha_args[t].id = t;
+		buddha_args[t].orbits = num_orbits / num_threads + (t < num_orbits % num_threads);
+		buddha_args[t].plotted = 0;
+		buddha_args[t].rng = (seed + 1) * 0x9E3779B97F4A7C15ULL + (uint64_t)t * 0xBF58476D1CE4E5B9ULL;
+		buddha_args[t].hist = calloc(total, sizeof(uint32_t));
+
+		if (buddha_args[t].hist == NULL)
+		{
+			printf("Error allocating Buddhabrot histogram for thread %d (%zu MB)\n", t, total * sizeof(uint32_t) >> 20);
+			exit(1);
+		}
+
+		// xorshift state must never be zero
+		if (buddha_args[t].rng == 0)
+		{
+			buddha_args[t].rng = 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int t = 0; t < num_threads; t++)
+	{
+		int ret = pthread_create(&threads[t], NULL, buddhabrot_process, &buddha_args[t]);
+
+		if (ret != 0)
+		{
+			printf("Error creating thread %d\n", t);
+			exit(1);
+		}
+	}
+	for (int t = 0; t < num_threads; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	long plotted = 0;
+	for (int t = 0; t < num_threads; t++)
+	{
+		plotted += buddha_args[t].plotted;
+		free(buddha_args[t].hist);
+	}
+
+	printf("buddhabrot: %ld orbits (%ld plotted) in %f s, %.0f orbits/s\n",
+		   num_orbits, plotted, seconds, seconds > 0 ? num_orbits / seconds : 0.0);
+
+	// Normalise each channel to its own peak
+	uint32_t peak[3] = {0, 0, 0};
+	for (size_t i = 0; i < total; i++)
+	{
+		if (histogram[i] > peak[i % 3])
+		{
+			peak[i % 3] = histogram[i];
+		}
+	}
+
+	for (unsigned int j = 0; j < img->height; j++)
+	{
+		for (unsigned int i = 0; i < img->width; i++)
+		{
+			uint32_t *bin = &histogram[((size_t)j * img->width + i) * 3];
+			unsigned char rgb[3];
+
+			for (int c = 0; c < 3; c++)
+			{
+				rgb[c] = peak[c] ? (unsigned char)(255 * sqrt((double)bin[c] / peak[c])) : 0;
+			}
+			setPixelRGB(img, i, j, rgb[0], rgb[1], rgb[2]);
+		}
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(histogram);
+	free(buddha_args);
+	free(cells);
+	free(cell_level);
+	free(cell_cdf);
+}
+
+/*
+Parse a Buddhabrot iteration band, given either as "max" or as "min:max".
+*/
+void parse_band(const char *arg, int channel)
+{
+	const char *colon = strchr(arg, ':');
+
+	if (colon == NULL)
+	{
+		band_min[channel] = 0;
+		band_max[channel] = atoi(arg);
+	}
+	else
+	{
+		band_min[channel] = atoi(arg);
+		band_max[channel] = atoi(colon + 1);
 	}
 }
 
@@ -251,6 +931,47 @@ int iteration_to_color(int iters, int max)
 	return color;
 }
 
+/*
+Convert an exterior distance estimate to a color.
+The gray level is the distance over DE_LINE_WIDTH pixels, clamped to 1, so the boundary is drawn
+as a dark line about DE_LINE_WIDTH pixels wide. The value changes smoothly between neighbouring
+pixels, so thin filaments stay sharp without speckle at one sample per pixel.
+Points inside the set (distance 0) are black.
+*/
+int distance_to_color(double distance, double pixel_size)
+{
+	double t = distance / (DE_LINE_WIDTH * pixel_size);
+
+	if (t > 1)
+	{
+		t = 1;
+	}
+
+	int gray = 255 * t;
+	return (gray << 16) | (gray << 8) | gray;
+}
+
+/*
+Return the peak signal-to-noise ratio between two images of the same size, in dB.
+*/
+double image_psnr(const imgRawImage *a, const imgRawImage *b)
+{
+	size_t total = (size_t)a->width * a->height * 3;
+	double sum = 0;
+
+	for (size_t i = 0; i < total; i++)
+	{
+		double diff = (double)a->lpData[i] - b->lpData[i];
+		sum += diff * diff;
+	}
+
+	if (sum == 0)
+	{
+		return INFINITY;
+	}
+	return 10 * log10(255.0 * 255.0 * total / sum);
+}
+
 // Show help message
 void show_help()
 {
@@ -263,9 +984,21 @@ void show_help()
 	printf("-W <pixels> Width of the image in pixels. (default=1000)\n");
 	printf("-H <pixels> Height of the image in pixels. (default=1000)\n");
 	printf("-o <file>   Set output file. (default=mandel.bmp)\n");
+	printf("-t <num>    Number of threads. (default=1)\n");
+	printf("-d          Color by exterior distance estimate instead of escape time.\n");
+	printf("-M          Color escape time as a mask, white outside the set and black inside.\n");
+	printf("-S <num>    Average num x num samples per pixel. (default=1)\n");
+	printf("-P <file>   Print the PSNR of the image against a reference JPEG.\n");
+	printf("-b          Render an orbit density (Buddhabrot) image instead.\n");
+	printf("-n <num>    Number of orbits to sample with -b. (default=10000000)\n");
+	printf("-R <band>   Iteration band min:max (or just max) of the red channel with -b. (default=0:max)\n");
+	printf("-G <band>   Iteration band min:max (or just max) of the green channel with -b. (default=0:max)\n");
+	printf("-B <band>   Iteration band min:max (or just max) of the blue channel with -b. (default=0:max)\n");
 	printf("-h          Show this help text.\n");
 	printf("\nSome examples are:\n");
 	printf("mandel -x -0.5 -y -0.5 -s 0.2\n");
 	printf("mandel -x -.38 -y -.665 -s .05 -m 100\n");
-	printf("mandel -x 0.286932 -y 0.014287 -s .0005 -m 1000\n\n");
+	printf("mandel -x 0.286932 -y 0.014287 -s .0005 -m 1000\n");
+	printf("mandel -d -x -0.743643 -y 0.131825 -s .0001 -m 5000\n");
+	printf("mandel -b -x -0.5 -n 50000000 -R 500:5000 -G 50:500 -B 10:50\n\n");
 }